@@ -17,19 +17,28 @@
  */
 
 #include "database.h"
+#include "secure.h"
 
 #include "polarssl/aes.h"
 #include "polarssl/sha256.h"
 
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define DATABASE_SIGNATURE 0x5057444d
-#define IV_SIZE 16
+#define IV_SIZE DATABASE_IV_SIZE
+
+// Files written before the versioned header are the IV followed by the encrypted data.
+#define LEGACY_FILE_SIZE (IV_SIZE + sizeof(struct database_header))
 
 #define DATABASE_ERROR_SYS -1
 #define DATABASE_ERROR_OK 0
@@ -38,6 +47,11 @@
 #define DATABASE_ERROR_ENCRYPT 3
 #define DATABASE_ERROR_DECRYPT 4
 #define DATABASE_ERROR_PASSPHRASE 5
+#define DATABASE_ERROR_FORMAT 6
+#define DATABASE_ERROR_VERSION 7
+#define DATABASE_ERROR_INTEGRITY 8
+#define DATABASE_ERROR_LOCKED 9
+#define DATABASE_ERROR_READONLY 10
 
 static int database_errno = 0;
 
@@ -50,128 +64,320 @@ static char *database_strerror(int error) {
 		case DATABASE_ERROR_ENCRYPT: return "Encryption failed";
 		case DATABASE_ERROR_DECRYPT: return "Decryption failed";
 		case DATABASE_ERROR_PASSPHRASE: return "Incorrect passphrase";
+		case DATABASE_ERROR_FORMAT: return "Not a password database";
+		case DATABASE_ERROR_VERSION: return "Unsupported database format";
+		case DATABASE_ERROR_INTEGRITY: return "Incorrect passphrase or corrupted database";
+		case DATABASE_ERROR_LOCKED: return "Database is in use by another process";
+		case DATABASE_ERROR_READONLY: return "Database is open read-only";
 		default: return "Unknown error";
 	}
 }
 
+static int derive_key(unsigned char *key, char *passphrase, uint32_t iterations) {
+	// Hash the passphrase using a context in locked memory, rehashing the result for further iterations.
+	sha256_context *ctx = (sha256_context *)secure_alloc(sizeof(sha256_context));
+	if(!ctx)
+		return -1;
+	sha256_starts(ctx, 0);
+	sha256_update(ctx, (unsigned char *)passphrase, strlen(passphrase));
+	sha256_finish(ctx, key);
+	for(uint32_t i = 1; i < iterations; i++) {
+		sha256_starts(ctx, 0);
+		sha256_update(ctx, key, DATABASE_KEY_SIZE);
+		sha256_finish(ctx, key);
+	}
+	secure_free(ctx);
+	return 0;
+}
+
+static int compute_mac(unsigned char *key, unsigned char *data, size_t n, unsigned char *mac) {
+	struct {
+		sha256_context ctx;
+		unsigned char mac_key[DATABASE_MAC_SIZE];
+	} *s = secure_alloc(sizeof(*s));
+	if(!s)
+		return -1;
+
+	// Use a separate key for the MAC rather than the encryption key itself.
+	sha256_hmac_starts(&s->ctx, key, DATABASE_KEY_SIZE, 0);
+	sha256_hmac_update(&s->ctx, (unsigned char *)"passwdm mac", 11);
+	sha256_hmac_finish(&s->ctx, s->mac_key);
+
+	sha256_hmac_starts(&s->ctx, s->mac_key, DATABASE_MAC_SIZE, 0);
+	sha256_hmac_update(&s->ctx, data, n);
+	sha256_hmac_finish(&s->ctx, mac);
+	secure_free(s);
+	return 0;
+}
+
+static int mac_equal(const unsigned char *a, const unsigned char *b) {
+	// Look at every byte so the time taken doesn't reveal how much of a forged MAC was right.
+	unsigned char diff = 0;
+	for(int i = 0; i < DATABASE_MAC_SIZE; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+static int check_file_header(struct database_file_header *fh, off_t size) {
+	if(memcmp(fh->magic, DATABASE_MAGIC, sizeof(fh->magic)) != 0) {
+		database_errno = DATABASE_ERROR_FORMAT;
+		return -1;
+	}
+
+	// Convert the header to host byte order before looking at it.
+	fh->version = le16toh(fh->version);
+	fh->kdf_iterations = le32toh(fh->kdf_iterations);
+	fh->data_size = le32toh(fh->data_size);
+
+	if(fh->version != DATABASE_FORMAT_VERSION || fh->cipher != DATABASE_CIPHER_AES256_CBC || fh->kdf != DATABASE_KDF_SHA256) {
+		database_errno = DATABASE_ERROR_VERSION;
+		return -1;
+	}
+	// The iteration count is read before the MAC can be checked, so bound the work a tampered file can cause.
+	if(fh->kdf_iterations == 0 || fh->kdf_iterations > DATABASE_KDF_MAX_ITERATIONS || fh->data_size != sizeof(struct database_header) || size != (off_t)(sizeof(*fh) + fh->data_size)) {
+		database_errno = DATABASE_ERROR_FORMAT;
+		return -1;
+	}
+	return 0;
+}
+
+static int lock_database(int fd, int readonly) {
+	// Readers share the database, writers have it to themselves.
+	if(flock(fd, (readonly ? LOCK_SH : LOCK_EX) | LOCK_NB) == -1) {
+		database_errno = errno == EWOULDBLOCK ? DATABASE_ERROR_LOCKED : DATABASE_ERROR_SYS;
+		return -1;
+	}
+	return 0;
+}
+
+static int open_locked(char *filename, int readonly) {
+	// Saves replace the file, so try again if it was replaced between opening and locking it.
+	for(int attempt = 0; attempt < 3; attempt++) {
+		int fd;
+		if((fd = open(filename, readonly ? O_RDONLY : O_RDWR)) == -1) {
+			database_errno = DATABASE_ERROR_SYS;
+			return -1;
+		}
+		if(lock_database(fd, readonly) != 0) {
+			close(fd);
+			return -1;
+		}
+		struct stat fd_st, path_st;
+		if(fstat(fd, &fd_st) == -1 || stat(filename, &path_st) == -1) {
+			database_errno = DATABASE_ERROR_SYS;
+			close(fd);
+			return -1;
+		}
+		if(fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+			return fd;
+		close(fd);
+	}
+	database_errno = DATABASE_ERROR_LOCKED;
+	return -1;
+}
+
 int create_database(struct database **database, char *filename, char *passphrase) {
 	// Open the database file.
 	int fd;
 	if((fd = open(filename, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) == -1) {
 		database_errno = DATABASE_ERROR_SYS;
+		explicit_bzero(passphrase, strlen(passphrase));
 		return -1;
 	}
 
-	// Setup the database structure.
-	struct database *d = (struct database *)calloc(1, sizeof(struct database));
+#define fail() 	explicit_bzero(passphrase, strlen(passphrase)); \
+				unlink(filename); \
+				if(d) \
+					close_database(d); \
+				else \
+					close(fd); \
+				return -1;
+
+	struct database *d = NULL;
+	if(lock_database(fd, 0) != 0) {
+		fail();
+	}
+
+	// Setup the database structure, in locked memory as it holds the key.
+	d = (struct database *)secure_alloc(sizeof(struct database));
 	if(!d) {
 		errno = ENOMEM;
 		database_errno = DATABASE_ERROR_SYS;
-		close(fd);
-		return -1;
+		fail();
 	}
 	d->fd = fd;
-	d->name = strdup(filename);
+	// Keep the real path so that saves replace the file itself rather than a symlink to it.
+	d->name = realpath(filename, NULL);
 	if(!d->name) {
-		errno = ENOMEM;
 		database_errno = DATABASE_ERROR_SYS;
-		free(d);
-		close(fd);
-		return -1;
+		fail();
 	}
-	d->header = (struct database_header *)malloc(sizeof(struct database_header));
-	if(!d->header) {
+	d->header.signature = DATABASE_SIGNATURE;
+	d->dirty = 1;
+	d->version = DATABASE_FORMAT_VERSION;
+	d->kdf_iterations = DATABASE_KDF_ITERATIONS;
+
+	// Generate the key.
+	int ret = derive_key(d->key, passphrase, d->kdf_iterations);
+
+	// Zero the passphrase.
+	explicit_bzero(passphrase, strlen(passphrase));
+
+	if(ret != 0) {
 		errno = ENOMEM;
 		database_errno = DATABASE_ERROR_SYS;
-		free(d->name);
-		free(d);
-		close(fd);
-		return -1;
+		fail();
 	}
-	d->header->signature = DATABASE_SIGNATURE;
 
-	// Generate the key.
-	sha256((unsigned char *)passphrase, strlen(passphrase), d->key, 0);
+	// Write the new database straight away so that an empty file is never left behind.
+	if(save_database(d) != 0) {
+		fail();
+	}
 
-	// Zero the password.
-	memset(passphrase, 0, strlen(passphrase));
+#undef fail
 
 	// Success.
 	*database = d;
 	return 0;
 }
 
-int open_database(struct database **database, char *filename, char *passphrase) {
-	// Open the database file.
+int open_database(struct database **database, char *filename, char *passphrase, int flags) {
+	// Resolve symlinks so that saves replace the file itself rather than a symlink to it.
+	char *path = realpath(filename, NULL);
+	if(!path) {
+		database_errno = DATABASE_ERROR_SYS;
+		explicit_bzero(passphrase, strlen(passphrase));
+		return -1;
+	}
+
+	// Open and lock the database file.
 	int fd;
-	if((fd = open(filename, O_RDWR)) == -1) {
-		database_errno = -1;
+	if((fd = open_locked(path, flags & DATABASE_READONLY)) == -1) {
+		explicit_bzero(passphrase, strlen(passphrase));
+		free(path);
 		return -1;
 	}
 
-#define fail() 	free(d->name); \
-				free(d->header); \
-				free(d); \
-				close(fd); \
+#define fail() 	explicit_bzero(passphrase, strlen(passphrase)); \
+				if(d) \
+					close_database(d); \
+				else { \
+					free(path); \
+					close(fd); \
+				} \
 				return -1;
 
-	// Setup the database structure.
-	struct database *d = (struct database *)calloc(1, sizeof(struct database));
+	// Setup the database structure, in locked memory as it holds the key.
+	struct database *d = (struct database *)secure_alloc(sizeof(struct database));
 	if(!d) {
 		errno = ENOMEM;
 		database_errno = DATABASE_ERROR_SYS;
 		fail();
 	}
 	d->fd = fd;
-	d->name = strdup(filename);
-	if(!d->name) {
-		errno = ENOMEM;
+	d->readonly = flags & DATABASE_READONLY;
+	d->name = path;
+
+	// Read the file header and encrypted data together, the file is only as large as both.
+	struct stat st;
+	struct database_file_header fh;
+	unsigned char data[sizeof(fh) + sizeof(d->header)];
+	if(fstat(fd, &st) == -1) {
 		database_errno = DATABASE_ERROR_SYS;
 		fail();
 	}
-	d->header = (struct database_header *)calloc(1, sizeof(struct database_header));
-	if(!d->header) {
-		errno = ENOMEM;
+	ssize_t n = read(fd, data, sizeof(data));
+	if(n == -1) {
 		database_errno = DATABASE_ERROR_SYS;
 		fail();
 	}
 
+	unsigned char *iv, *encrypted;
+	if(st.st_size == (off_t)LEGACY_FILE_SIZE && n == st.st_size && memcmp(data, DATABASE_MAGIC, sizeof(fh.magic)) != 0) {
+		// Files without a header can only be recognised by decrypting them, their key is a single SHA-256.
+		d->version = 0;
+		d->kdf_iterations = 1;
+		iv = data;
+		encrypted = data + IV_SIZE;
+	}
+	else {
+		// Check the header describes something this version can read before deriving the key.
+		if(n < (ssize_t)sizeof(fh)) {
+			database_errno = DATABASE_ERROR_FORMAT;
+			fail();
+		}
+		memcpy(&fh, data, sizeof(fh));
+		if(check_file_header(&fh, st.st_size) != 0) {
+			fail();
+		}
+		if(n != st.st_size) {
+			database_errno = DATABASE_ERROR_IO;
+			fail();
+		}
+		d->version = fh.version;
+		d->kdf_iterations = fh.kdf_iterations;
+		iv = fh.iv;
+		encrypted = data + sizeof(fh);
+	}
+
 	// Generate the key.
-	sha256((unsigned char *)passphrase, strlen(passphrase), d->key, 0);
+	int ret = derive_key(d->key, passphrase, d->kdf_iterations);
 
 	// Zero the passphrase.
-	memset(passphrase, 0, strlen(passphrase));
+	explicit_bzero(passphrase, strlen(passphrase));
 
-	// Read IV first.
-	unsigned char iv[IV_SIZE];
-	if(read(fd, iv, IV_SIZE) < IV_SIZE) {
-		database_errno = DATABASE_ERROR_IO;
+	if(ret != 0) {
+		errno = ENOMEM;
+		database_errno = DATABASE_ERROR_SYS;
 		fail();
 	}
 
-	// Read encrypted data.
-	if(read(fd, d->header, sizeof(*d->header)) < (signed)sizeof(sizeof(*d->header))) {
-		database_errno = DATABASE_ERROR_IO;
-		fail();
+	// Check the MAC, computed with the MAC field zeroed, before decrypting anything.
+	if(d->version > 0) {
+		unsigned char mac[DATABASE_MAC_SIZE];
+		memset(data + offsetof(struct database_file_header, mac), 0, DATABASE_MAC_SIZE);
+		if(compute_mac(d->key, data, n, mac) != 0) {
+			errno = ENOMEM;
+			database_errno = DATABASE_ERROR_SYS;
+			fail();
+		}
+		if(!mac_equal(mac, fh.mac)) {
+			database_errno = DATABASE_ERROR_INTEGRITY;
+			fail();
+		}
 	}
 
 	// Decrypt the data.
-	aes_context ctx;
-	if(aes_setkey_dec(&ctx, d->key, DATABASE_KEY_SIZE * 8) != 0) {
+	aes_context *ctx = (aes_context *)secure_alloc(sizeof(aes_context));
+	if(!ctx) {
+		errno = ENOMEM;
+		database_errno = DATABASE_ERROR_SYS;
+		fail();
+	}
+	if(aes_setkey_dec(ctx, d->key, DATABASE_KEY_SIZE * 8) != 0) {
+		secure_free(ctx);
 		database_errno = DATABASE_ERROR_KEY;
 		fail();
 	}
-	if(aes_crypt_cbc(&ctx, AES_DECRYPT, sizeof(*d->header), iv, (unsigned char *)d->header, (unsigned char *)d->header) != 0) {
+	ret = aes_crypt_cbc(ctx, AES_DECRYPT, sizeof(d->header), iv, encrypted, (unsigned char *)&d->header);
+	secure_free(ctx);
+	if(ret != 0) {
 		database_errno = DATABASE_ERROR_DECRYPT;
 		fail();
 	}
 
 	// Validate the database.
-	if(d->header->signature != DATABASE_SIGNATURE) {
+	if(d->header.signature != DATABASE_SIGNATURE) {
 		database_errno = DATABASE_ERROR_PASSPHRASE;
 		fail();
 	}
 
+	// Upgrade files in the old layout, if this fails it is retried when the database is saved.
+	if(d->version == 0 && !d->readonly) {
+		d->dirty = 1;
+		save_database(d);
+	}
+
 	// Success.
 	*database = d;
 	return 0;
@@ -179,55 +385,173 @@ int open_database(struct database **database, char *filename, char *passphrase)
 #undef fail
 }
 
-int save_database(struct database *database) {
-	// Start writing at the beginning of the file.
-	if(lseek(database->fd, 0, SEEK_SET) != 0) {
+int probe_database(char *filename, unsigned int *version) {
+	int fd;
+	if((fd = open(filename, O_RDONLY)) == -1) {
 		database_errno = DATABASE_ERROR_SYS;
 		return -1;
 	}
 
-	// Prepare data to be written.
-	ssize_t n = (ssize_t)sizeof(*database->header);
-	unsigned char *encrypted = (unsigned char *)calloc(n, sizeof(unsigned char));
-	if(!encrypted) {
-		errno = ENOMEM;
+	// Only the plaintext header is needed to tell which format a file uses and whether it is well formed.
+	struct stat st;
+	struct database_file_header fh;
+	if(fstat(fd, &st) == -1) {
 		database_errno = DATABASE_ERROR_SYS;
+		close(fd);
 		return -1;
 	}
+	ssize_t n = pread(fd, &fh, sizeof(fh), 0);
+	close(fd);
+	if(n == -1) {
+		database_errno = DATABASE_ERROR_SYS;
+		return -1;
+	}
+	if(st.st_size == (off_t)LEGACY_FILE_SIZE && memcmp(fh.magic, DATABASE_MAGIC, sizeof(fh.magic)) != 0) {
+		*version = 0;
+		return 0;
+	}
+	if(n < (ssize_t)sizeof(fh)) {
+		database_errno = DATABASE_ERROR_FORMAT;
+		return -1;
+	}
+	if(check_file_header(&fh, st.st_size) != 0)
+		return -1;
+	*version = fh.version;
+	return 0;
+}
+
+static int sync_directory(char *filename) {
+	// Find the directory containing the file.
+	char *slash = strrchr(filename, '/');
+	char *dirname = slash ? strndup(filename, slash - filename + 1) : strdup(".");
+	if(!dirname) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// Flush the directory so that a rename is durable.
+	int fd = open(dirname, O_RDONLY | O_DIRECTORY);
+	free(dirname);
+	if(fd == -1)
+		return -1;
+	if(fsync(fd) == -1) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
 
-	// Prepare IV.
-	unsigned char iv[IV_SIZE], iv_updated[IV_SIZE];
-	memcpy(iv, "1234567890123456", IV_SIZE);
-	memcpy(iv_updated, iv, IV_SIZE);
+int save_database(struct database *database) {
+	// Changes are coalesced until the database is saved, so there is nothing to do if nothing changed.
+	if(!database->dirty)
+		return 0;
+	if(database->readonly) {
+		database_errno = DATABASE_ERROR_READONLY;
+		return -1;
+	}
+
+	// Prepare data to be written, the file header followed by the encrypted data.
+	struct database_file_header fh;
+	ssize_t n = (ssize_t)sizeof(database->header);
+	unsigned char data[sizeof(fh) + sizeof(database->header)];
+	memset(&fh, 0, sizeof(fh));
+	memcpy(fh.magic, DATABASE_MAGIC, sizeof(fh.magic));
+	fh.version = htole16(DATABASE_FORMAT_VERSION);
+	fh.cipher = DATABASE_CIPHER_AES256_CBC;
+	fh.kdf = DATABASE_KDF_SHA256;
+	fh.kdf_iterations = htole32(database->kdf_iterations);
+	fh.data_size = htole32(n);
+
+	// Prepare a fresh IV for every save.
+	unsigned char iv_updated[IV_SIZE];
+	if(getrandom(fh.iv, IV_SIZE, 0) != IV_SIZE) {
+		database_errno = DATABASE_ERROR_SYS;
+		return -1;
+	}
+	memcpy(iv_updated, fh.iv, IV_SIZE);
 
 	// Encrypt.
-	aes_context ctx;
-	if(aes_setkey_enc(&ctx, database->key, DATABASE_KEY_SIZE * 8) != 0) {
+	aes_context *ctx = (aes_context *)secure_alloc(sizeof(aes_context));
+	if(!ctx) {
+		errno = ENOMEM;
+		database_errno = DATABASE_ERROR_SYS;
+		return -1;
+	}
+	if(aes_setkey_enc(ctx, database->key, DATABASE_KEY_SIZE * 8) != 0) {
+		secure_free(ctx);
 		database_errno = DATABASE_ERROR_KEY;
-		free(encrypted);
 		return -1;
 	}
-	if(aes_crypt_cbc(&ctx, AES_ENCRYPT, n, iv_updated, (unsigned char *)database->header, encrypted) != 0) {
+	int ret = aes_crypt_cbc(ctx, AES_ENCRYPT, n, iv_updated, (unsigned char *)&database->header, data + sizeof(fh));
+	secure_free(ctx);
+	if(ret != 0) {
 		database_errno = DATABASE_ERROR_ENCRYPT;
-		free(encrypted);
 		return -1;
 	}
 
-	// Write IV first.
-	if(write(database->fd, iv, IV_SIZE) < IV_SIZE) {
-		database_errno = DATABASE_ERROR_IO;
-		free(encrypted);
+	// Authenticate the header and encrypted data, the MAC is computed with its own field zeroed.
+	memcpy(data, &fh, sizeof(fh));
+	if(compute_mac(database->key, data, sizeof(data), fh.mac) != 0) {
+		errno = ENOMEM;
+		database_errno = DATABASE_ERROR_SYS;
+		return -1;
+	}
+	memcpy(data + offsetof(struct database_file_header, mac), fh.mac, DATABASE_MAC_SIZE);
+
+	// Write to a temporary file next to the database so that the database is never partially written.
+	// It is hidden so that one left behind by a crash is never mistaken for a database.
+	char *slash = strrchr(database->name, '/');
+	int dirlen = slash ? (int)(slash - database->name + 1) : 0;
+	char *tmpname;
+	if(asprintf(&tmpname, "%.*s.%s.XXXXXX", dirlen, database->name, database->name + dirlen) == -1) {
+		errno = ENOMEM;
+		database_errno = DATABASE_ERROR_SYS;
 		return -1;
 	}
+	int fd;
+	if((fd = mkstemp(tmpname)) == -1) {
+		database_errno = DATABASE_ERROR_SYS;
+		free(tmpname);
+		return -1;
+	}
+
+#define fail() 	unlink(tmpname); \
+				free(tmpname); \
+				close(fd); \
+				return -1;
 
-	// Write encrypted data.
-	if(write(database->fd, encrypted, n) < n) {
+	// Lock the new file before it replaces the database so that it is never unlocked.
+	if(lock_database(fd, 0) != 0) {
+		fail();
+	}
+	if(write(fd, data, sizeof(data)) < (ssize_t)sizeof(data)) {
 		database_errno = DATABASE_ERROR_IO;
-		free(encrypted);
-		return -1;
+		fail();
+	}
+	if(fdatasync(fd) == -1) {
+		database_errno = DATABASE_ERROR_SYS;
+		fail();
+	}
+
+	// Replace the database with the new file.
+	if(rename(tmpname, database->name) == -1) {
+		database_errno = DATABASE_ERROR_SYS;
+		fail();
 	}
+	free(tmpname);
 
-	free(encrypted);
+#undef fail
+
+	// The new file is now the database, so switch to it even if the rename cannot be made durable.
+	close(database->fd);
+	database->fd = fd;
+	database->version = DATABASE_FORMAT_VERSION;
+	if(sync_directory(database->name) == -1) {
+		// Leave the database dirty so the next save tries again.
+		database_errno = DATABASE_ERROR_SYS;
+		return -1;
+	}
+	database->dirty = 0;
 	return 0;
 }
 
@@ -236,8 +560,9 @@ void close_database(struct database *database) {
 		return;
 	close(database->fd);
 	free(database->name);
-	free(database->header);
-	free(database);
+
+	// Releasing the slot wipes the key and decrypted data.
+	secure_free(database);
 }
 
 void database_perror(char *s) {
@@ -23,6 +23,32 @@
 
 #define DATABASE_KEY_SIZE 32
 
+#define DATABASE_MAGIC "PWDM"
+#define DATABASE_FORMAT_VERSION 1
+#define DATABASE_CIPHER_AES256_CBC 1
+#define DATABASE_KDF_SHA256 1
+#define DATABASE_KDF_ITERATIONS 1
+#define DATABASE_KDF_MAX_ITERATIONS 1000000
+#define DATABASE_IV_SIZE 16
+#define DATABASE_MAC_SIZE 32
+
+// Flags for open_database.
+#define DATABASE_READONLY 0x1
+
+// Plaintext header at the start of every database file, followed by data_size bytes of encrypted data. The MAC
+// covers the rest of the header and the encrypted data. Multi-byte fields are stored little-endian.
+struct database_file_header {
+	char magic[4];
+	uint16_t version;
+	uint8_t cipher;
+	uint8_t kdf;
+	uint32_t kdf_iterations;
+	uint32_t data_size;
+	unsigned char iv[DATABASE_IV_SIZE];
+	unsigned char mac[DATABASE_MAC_SIZE];
+};
+
+// Encrypted data.
 struct database_header {
 	uint32_t signature;
 	uint32_t signature2;
@@ -33,13 +59,18 @@ struct database_header {
 struct database {
 	char *name;
 	int fd;
+	int readonly;
+	int dirty;
+	unsigned int version;
+	uint32_t kdf_iterations;
 	unsigned char key[DATABASE_KEY_SIZE];
-	struct database_header *header;
+	struct database_header header;
 };
 
 int create_database(struct database **, char *, char *);
-int open_database(struct database **, char *, char *);
+int open_database(struct database **, char *, char *, int);
 int save_database(struct database *);
+int probe_database(char *, unsigned int *);
 void close_database(struct database *);
 
 void database_perror(char *);
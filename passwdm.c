@@ -17,32 +17,145 @@
  */
 
 #include "database.h"
+#include "secure.h"
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #define COMMAND_DELIMETERS " \t\r\n"
+#define MAX_ARGUMENTS 8
 #define DEFAULT_PROMPT "> "
+#define SESSION_DATABASES 4
+#define SESSION_IDLE_TIMEOUT (15 * 60)
 
-static void perform_command(char *);
-static void save_and_close();
+struct session_database {
+	struct database *db;
+	char *name;
+	long long last_used;
+};
+
+// Per-session state, commands only touch the session they are run for. Several databases can be open at
+// once, the least recently used is closed to make room and any left idle for too long are closed.
+struct session {
+	struct session_database databases[SESSION_DATABASES];
+	struct session_database *current;
+	char *prompt;
+};
+
+// Running totals for commands that look at every database.
+struct search {
+	char *text;
+	int found;
+};
+
+struct verify {
+	int checked;
+	int failed;
+};
+
+static void usage();
+static void run_interactive();
+static int run_batch(FILE *, int);
+static char *read_passphrase(char *);
+static int idle_hook();
+static int perform_command(struct session *, char *);
+static int dispatch(struct session *, int, char **);
+static int tokenize(char *, char **, int);
+static int command_create(struct session *, int, char **);
+static int command_open(struct session *, int, char **);
+static int open_or_create(struct session *, char *, int, int);
+static int command_close(struct session *, int, char **);
+static int command_use(struct session *, int, char **);
+static int command_upgrade(struct session *, int, char **);
+static int upgrade_entry(char *, void *);
+static int command_search(struct session *, int, char **);
+static int search_entry(char *, void *);
+static int command_verify_all(struct session *, int, char **);
+static int verify_entry(char *, void *);
+static int command_stats(struct session *, int, char **);
+static int add_database(struct session *, char *, struct database *);
+static struct session_database *find_database(struct session *, char *);
+static struct session_database *find_file(struct session *, char *);
+static struct session_database *find_idle(struct session *);
+static void close_idle(struct session *);
+static void use_database(struct session *, struct session_database *);
+static int save_and_close(struct session *, struct session_database *);
+static int close_all(struct session *);
+static long long now();
+static int upgrade(char *, int);
+static int scan_databases(int (*)(char *, void *), void *);
+static int matches(const char *, const char *);
 
 static char *db_dir = NULL;
-static char *prompt = DEFAULT_PROMPT;
-static struct database *db = NULL;
+static char default_prompt[] = DEFAULT_PROMPT;
+static struct session main_session = { .current = NULL, .prompt = default_prompt };
+static FILE *passphrase_file = NULL;
 
-int main() {
-	// Check that password database directory exists, and if not creates it.
+// Commands with the number of arguments they take, and what to say when arguments are missing.
+static const struct command {
+	char *name;
+	int min_args;
+	int max_args;
+	char *missing;
+	int (*handler)(struct session *, int, char **);
+} commands[] = {
+	{ "create", 1, 1, "Password database name required.", command_create },
+	{ "open", 1, 2, "Password database name required.", command_open },
+	{ "close", 0, 1, NULL, command_close },
+	{ "use", 0, 1, NULL, command_use },
+	{ "upgrade", 0, 1, NULL, command_upgrade },
+	{ "search", 1, 1, "Search text required.", command_search },
+	{ "verify-all", 0, 0, NULL, command_verify_all },
+	{ "stats", 0, 0, NULL, command_stats },
+};
+
+int main(int argc, char **argv) {
+	// Parse options.
+	char *script = NULL;
+	int keep_going = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "+b:kp:")) != -1) {
+		switch(opt) {
+			case 'b':
+				script = optarg;
+				break;
+			case 'k':
+				keep_going = 1;
+				break;
+			case 'p': {
+				char *end;
+				long fd = strtol(optarg, &end, 10);
+				if(*optarg == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX || (passphrase_file = fdopen((int)fd, "r")) == NULL) {
+					fprintf(stderr, "Invalid passphrase file descriptor: %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if((optind < argc && script != NULL) || (keep_going && script == NULL)) {
+		usage();
+		return 1;
+	}
+
+	// Locate the password database directory, it is created when the first database is.
 	char *home_dir = getenv("HOME");
 	if(home_dir == NULL) {
 		fprintf(stderr, "Unable to locate home directory.");
@@ -52,22 +165,51 @@ int main() {
 		fprintf(stderr, "Out of memory.\n");
 		return 1;
 	}
-	if(mkdir(db_dir, S_IRUSR | S_IWUSR | S_IXUSR) == -1 && errno != EEXIST) {
-		fprintf(stderr, "Unable to create password database directory.\n");
-		return 1;
+
+	// Run a single command given as arguments, from a script, or interactively.
+	int ret = 0;
+	if(optind < argc) {
+		// The shell has already split and unquoted the arguments.
+		ret = dispatch(&main_session, argc - optind, argv + optind);
+	}
+	else if(script != NULL) {
+		FILE *in = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+		if(in == NULL) {
+			fprintf(stderr, "Unable to open %s: %s\n", script, strerror(errno));
+			return 1;
+		}
+		ret = run_batch(in, keep_going);
+		if(in != stdin)
+			fclose(in);
+	}
+	else {
+		run_interactive();
 	}
 
+	if(close_all(&main_session) != 0)
+		ret = -1;
+	return ret == 0 ? 0 : 1;
+}
+
+void usage() {
+	fprintf(stderr, "Usage: passwdm [-p fd] [-b script [-k] | command [argument ...]]\n");
+}
+
+void run_interactive() {
 	// Prevent TAB from auto-completing file names.
 	rl_bind_key('\t', rl_insert);
 
+	// Check for idle databases while waiting for input.
+	rl_event_hook = idle_hook;
+
 	// Read commands from the user.
 	char *command;
 	while(1) {
-		command = readline(prompt);
+		command = readline(main_session.prompt);
 		if(command == NULL) {
-			if(db != NULL) {
+			if(main_session.current != NULL) {
 				printf("close\n");
-				save_and_close();
+				save_and_close(&main_session, main_session.current);
 				continue;
 			}
 			else {
@@ -85,122 +227,590 @@ int main() {
 			break;
 		// Handle commands.
 		else
-			perform_command(command);
+			perform_command(&main_session, command);
 
 		free(command);
 	}
+	free(command);
+}
+
+int run_batch(FILE *in, int keep_going) {
+	// Read newline-delimited commands, without readline or history, stopping at the first failure unless asked not to.
+	char *command = NULL;
+	size_t size = 0;
+	ssize_t n;
+	int ret = 0;
+	while((n = getline(&command, &size, in)) != -1) {
+		if(n > 0 && command[n - 1] == '\n')
+			command[n - 1] = '\0';
 
-	save_and_close();
+		// Catch exit commands.
+		if(strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0)
+			break;
+		// Handle commands.
+		else if(perform_command(&main_session, command) != 0) {
+			ret = -1;
+			if(!keep_going)
+				break;
+		}
+	}
+	free(command);
+	return ret;
+}
+
+char *read_passphrase(char *pass_prompt) {
+	if(passphrase_file == NULL)
+		return getpass(pass_prompt);
+
+	// Read one passphrase per line from the passphrase file descriptor.
+	static char *line = NULL;
+	static size_t size = 0;
+	ssize_t n = getline(&line, &size, passphrase_file);
+	if(n == -1)
+		return NULL;
+	if(n > 0 && line[n - 1] == '\n')
+		line[n - 1] = '\0';
+	return line;
+}
+
+int idle_hook() {
+	if(find_idle(&main_session) != NULL) {
+		// Move off the line being edited to report the databases being closed, then redraw it.
+		printf("\n");
+		close_idle(&main_session);
+		rl_set_prompt(main_session.prompt);
+		rl_on_new_line();
+		rl_redisplay();
+	}
 	return 0;
 }
 
-void perform_command(char *command) {
-	char *keyword = strtok(command, COMMAND_DELIMETERS);
-	if(keyword == NULL)
-		return;
-	// Create a password database.
-	else if(strcmp(keyword, "create") == 0) {
-		// Get the database name.
-		char *db_name = strtok(NULL, COMMAND_DELIMETERS);
-		char *arg = strtok(NULL, COMMAND_DELIMETERS);
-		if(arg != NULL) {
-			printf("Unknown argument: %s\n", arg);
-		}
-		else if(db_name == NULL) {
-			printf("Password database name required.\n");
-		}
-		else if(db != NULL) {
-			printf("Current password database must be closed before another one can be created.\n");
+int perform_command(struct session *session, char *command) {
+	char *argv[MAX_ARGUMENTS];
+	int argc = tokenize(command, argv, MAX_ARGUMENTS);
+	if(argc == -1) {
+		printf("Unterminated quote.\n");
+		return -1;
+	}
+	if(argc == 0)
+		return 0;
+	if(argc > MAX_ARGUMENTS) {
+		printf("Too many arguments.\n");
+		return -1;
+	}
+	return dispatch(session, argc, argv);
+}
+
+int dispatch(struct session *session, int argc, char **argv) {
+	// Close databases that have been idle for too long before doing anything else.
+	close_idle(session);
+	if(session->current != NULL)
+		session->current->last_used = now();
+
+	// Find the command and check its arguments before running it.
+	for(size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		const struct command *c = &commands[i];
+		if(strcmp(argv[0], c->name) != 0)
+			continue;
+		if(argc - 1 > c->max_args) {
+			printf("Unknown argument: %s\n", argv[c->max_args + 1]);
+			return -1;
 		}
-		// Change to the database and update the prompt.
-		else {
-			char *db_filename;
-			if(asprintf(&db_filename, "%s/%s", db_dir, db_name) == -1) {
-				fprintf(stderr, "Out of memory.\n");
-				return;
-			}
-			if(asprintf(&prompt, "%s> ", db_name) == -1) {
-				fprintf(stderr, "Out of memory.\n");
-				prompt = DEFAULT_PROMPT;
-				return;
-			}
-			char *pass_prompt;
-			if(asprintf(&pass_prompt, "Passphrase for %s: ", db_name) == -1) {
-				fprintf(stderr, "Out of memory.\n");
-				return;
-			}
-			char *passphrase = getpass(pass_prompt);
-			if(create_database(&db, db_filename, passphrase) != 0) {
-				database_perror("Error creating database");
-				prompt = DEFAULT_PROMPT;
-				return;
-			}
+		if(argc - 1 < c->min_args) {
+			printf("%s\n", c->missing);
+			return -1;
 		}
+		return c->handler(session, argc - 1, argv + 1);
 	}
-	// Open a password database.
-	else if(strcmp(keyword, "open") == 0) {
-		// Get the database name.
-		char *db_name = strtok(NULL, COMMAND_DELIMETERS);
-		char *arg = strtok(NULL, COMMAND_DELIMETERS);
-		if(arg != NULL) {
-			printf("Unknown argument: %s\n", arg);
+	printf("%s: command not found.\n", argv[0]);
+	return -1;
+}
+
+int tokenize(char *command, char **argv, int max) {
+	// Split the command in place, removing quotes, so arguments point into the command itself.
+	int argc = 0;
+	char *in = command;
+	while(1) {
+		while(*in != '\0' && strchr(COMMAND_DELIMETERS, *in) != NULL)
+			in++;
+		if(*in == '\0')
+			return argc;
+
+		char *out = in;
+		if(argc < max)
+			argv[argc] = out;
+		argc++;
+
+		// Delimiters inside single or double quotes are part of the argument.
+		char quote = '\0';
+		while(*in != '\0' && (quote != '\0' || strchr(COMMAND_DELIMETERS, *in) == NULL)) {
+			if(quote != '\0' && *in == quote)
+				quote = '\0';
+			else if(quote == '\0' && (*in == '"' || *in == '\''))
+				quote = *in;
+			else
+				*out++ = *in;
+			in++;
 		}
-		else if(db_name == NULL) {
-			printf("Password database name required.\n");
+		if(quote != '\0')
+			return -1;
+		if(*in != '\0')
+			in++;
+		*out = '\0';
+	}
+}
+
+int command_create(struct session *session, int argc, char **argv) {
+	(void)argc;
+
+	// Check that password database directory exists, and if not creates it.
+	if(mkdir(db_dir, S_IRUSR | S_IWUSR | S_IXUSR) == -1 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create password database directory.\n");
+		return -1;
+	}
+	return open_or_create(session, argv[0], 1, 0);
+}
+
+int command_open(struct session *session, int argc, char **argv) {
+	// Get the database name, and whether to open it read-only.
+	int flags = 0;
+	char *db_name = argv[0];
+	if(strcmp(argv[0], "--readonly") == 0) {
+		flags |= DATABASE_READONLY;
+		db_name = argc > 1 ? argv[1] : NULL;
+	}
+	else if(argc > 1) {
+		printf("Unknown argument: %s\n", argv[1]);
+		return -1;
+	}
+
+	if(db_name == NULL) {
+		printf("Password database name required.\n");
+		return -1;
+	}
+	// Switch to the database if it is already open, under this name or another path to the same file.
+	struct session_database *sd = find_file(session, db_name);
+	if(sd != NULL) {
+		if(!sd->db->readonly != !(flags & DATABASE_READONLY)) {
+			printf("%s is already open %s, close it first.\n", sd->name, sd->db->readonly ? "read-only" : "read-write");
+			return -1;
 		}
-		else if(db != NULL) {
-			printf("Current password database must be closed before another one can be opened.\n");
+		use_database(session, sd);
+		return 0;
+	}
+	return open_or_create(session, db_name, 0, flags);
+}
+
+int open_or_create(struct session *session, char *db_name, int create, int flags) {
+	char *db_filename;
+	if(asprintf(&db_filename, "%s/%s", db_dir, db_name) == -1) {
+		fprintf(stderr, "Out of memory.\n");
+		return -1;
+	}
+	char *pass_prompt;
+	if(asprintf(&pass_prompt, "Passphrase for %s: ", db_name) == -1) {
+		fprintf(stderr, "Out of memory.\n");
+		free(db_filename);
+		return -1;
+	}
+	char *passphrase = read_passphrase(pass_prompt);
+	free(pass_prompt);
+
+	// Change to the database and update the prompt.
+	struct database *d;
+	int ret = -1;
+	if(passphrase == NULL) {
+		printf("Passphrase required.\n");
+	}
+	else if(create && create_database(&d, db_filename, passphrase) != 0) {
+		database_perror("Error creating database");
+	}
+	else if(!create && open_database(&d, db_filename, passphrase, flags) != 0) {
+		database_perror("Error opening database");
+	}
+	else {
+		ret = add_database(session, db_name, d);
+	}
+	free(db_filename);
+	return ret;
+}
+
+int command_close(struct session *session, int argc, char **argv) {
+	if(argc == 0 && session->current == NULL) {
+		printf("No password database currently open.\n");
+		return -1;
+	}
+	if(argc == 0)
+		return save_and_close(session, session->current);
+	if(find_database(session, argv[0]) == NULL) {
+		printf("%s is not open.\n", argv[0]);
+		return -1;
+	}
+	return save_and_close(session, find_database(session, argv[0]));
+}
+
+int command_use(struct session *session, int argc, char **argv) {
+	if(argc == 1) {
+		if(find_database(session, argv[0]) == NULL) {
+			printf("%s is not open.\n", argv[0]);
+			return -1;
 		}
-		// Change to the database and update the prompt.
-		else {
-			char *db_filename;
-			if(asprintf(&db_filename, "%s/%s", db_dir, db_name) == -1) {
-				fprintf(stderr, "Out of memory.\n");
-				return;
-			}
-			if(asprintf(&prompt, "%s> ", db_name) == -1) {
-				fprintf(stderr, "Out of memory.\n");
-				prompt = DEFAULT_PROMPT;
-				return;
-			}
-			char *pass_prompt;
-			if(asprintf(&pass_prompt, "Passphrase for %s: ", db_name) == -1) {
-				fprintf(stderr, "Out of memory.\n");
-				return;
-			}
-			char *passphrase = getpass(pass_prompt);
-			if(open_database(&db, db_filename, passphrase) != 0) {
-				database_perror("Error opening database");
-				prompt = DEFAULT_PROMPT;
-				return;
-			}
+		use_database(session, find_database(session, argv[0]));
+		return 0;
+	}
+
+	// List the open databases.
+	int found = 0;
+	for(int i = 0; i < SESSION_DATABASES; i++) {
+		struct session_database *sd = &session->databases[i];
+		if(sd->db == NULL)
+			continue;
+		printf("%c %s (idle %llds)\n", sd == session->current ? '*' : ' ', sd->name, (now() - sd->last_used) / 1000);
+		found++;
+	}
+	if(!found)
+		printf("No password databases currently open.\n");
+	return 0;
+}
+
+int command_upgrade(struct session *session, int argc, char **argv) {
+	(void)session;
+	if(argc == 1)
+		return upgrade(argv[0], 1);
+
+	int failed = 0;
+	if(scan_databases(upgrade_entry, &failed) != 0)
+		return -1;
+	return failed ? -1 : 0;
+}
+
+int upgrade_entry(char *db_name, void *data) {
+	// Keep upgrading the remaining databases when one fails.
+	if(upgrade(db_name, 0) != 0)
+		(*(int *)data)++;
+	return 0;
+}
+
+int command_search(struct session *session, int argc, char **argv) {
+	(void)session;
+	(void)argc;
+	struct search search = { .text = argv[0], .found = 0 };
+	if(scan_databases(search_entry, &search) != 0)
+		return -1;
+	if(!search.found)
+		printf("No password databases found.\n");
+	return 0;
+}
+
+int search_entry(char *db_name, void *data) {
+	struct search *search = data;
+	if(matches(db_name, search->text)) {
+		printf("%s\n", db_name);
+		search->found++;
+	}
+	return 0;
+}
+
+int command_verify_all(struct session *session, int argc, char **argv) {
+	(void)session;
+	(void)argc;
+	(void)argv;
+	struct verify verify = { .checked = 0, .failed = 0 };
+	int ret = scan_databases(verify_entry, &verify);
+	printf("%d password databases checked, %d failed.\n", verify.checked, verify.failed);
+	return ret != 0 || verify.failed ? -1 : 0;
+}
+
+int verify_entry(char *db_name, void *data) {
+	struct verify *verify = data;
+	char *db_filename;
+	if(asprintf(&db_filename, "%s/%s", db_dir, db_name) == -1) {
+		fprintf(stderr, "Out of memory.\n");
+		verify->failed++;
+		return -1;
+	}
+
+	// Time each check so slow files stand out.
+	struct timespec start, end;
+	unsigned int version;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret = probe_database(db_filename, &version);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	free(db_filename);
+
+	verify->checked++;
+	if(ret != 0) {
+		char *label;
+		verify->failed++;
+		if(asprintf(&label, "%s (%.3f ms)", db_name, ms) == -1) {
+			fprintf(stderr, "Out of memory.\n");
+			return -1;
 		}
+		database_perror(label);
+		free(label);
+	}
+	else if(version == 0)
+		printf("%s: old format, run upgrade to convert (%.3f ms)\n", db_name, ms);
+	else
+		printf("%s: OK, version %u (%.3f ms)\n", db_name, version, ms);
+	return 0;
+}
+
+int command_stats(struct session *session, int argc, char **argv) {
+	(void)argc;
+	(void)argv;
+	if(session->current == NULL) {
+		printf("No password database currently open.\n");
+		return -1;
+	}
+
+	struct database *db = session->current->db;
+	struct stat st;
+	if(fstat(db->fd, &st) == -1) {
+		perror("Error reading database size");
+		return -1;
 	}
-	// Close the current password database.
-	else if(strcmp(keyword, "close") == 0) {
-		char *arg = strtok(NULL, COMMAND_DELIMETERS);
-		if(db == NULL) {
-			printf("No password database currently open.\n");
+	printf("Database: %s\n", db->name);
+	printf("Size: %lld bytes\n", (long long)st.st_size);
+	if(db->version == 0)
+		printf("Format: legacy\n");
+	else
+		printf("Format: version %u\n", db->version);
+	printf("Mode: %s\n", db->readonly ? "read-only" : "read-write");
+	printf("Unsaved changes: %s\n", db->dirty ? "yes" : "no");
+
+	struct secure_usage usage;
+	secure_usage(&usage);
+	printf("Secure memory: %zu/%zu slots of %zu bytes in use (%s)\n", usage.slots_used, usage.slots_total,
+			usage.slot_size, usage.locked ? "locked" : "not locked");
+	return 0;
+}
+
+int add_database(struct session *session, char *db_name, struct database *d) {
+	// Use a free slot, or close the least recently used database to make one.
+	struct session_database *slot = NULL;
+	for(int i = 0; i < SESSION_DATABASES; i++) {
+		struct session_database *sd = &session->databases[i];
+		if(sd->db == NULL) {
+			slot = sd;
+			break;
 		}
-		else if(arg != NULL && strcmp(arg, db->name) != 0) {
-			printf("Unknown argument: %s\n", arg);
+		if(slot == NULL || sd->last_used < slot->last_used)
+			slot = sd;
+	}
+	if(slot->db != NULL) {
+		printf("Closing least recently used password database %s.\n", slot->name);
+		save_and_close(session, slot);
+	}
+
+	slot->name = strdup(db_name);
+	if(slot->name == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		if(!d->readonly && save_database(d) != 0)
+			database_perror("Error saving database");
+		close_database(d);
+		return -1;
+	}
+	slot->db = d;
+	use_database(session, slot);
+	return 0;
+}
+
+struct session_database *find_database(struct session *session, char *db_name) {
+	for(int i = 0; i < SESSION_DATABASES; i++) {
+		struct session_database *sd = &session->databases[i];
+		if(sd->db != NULL && strcmp(sd->name, db_name) == 0)
+			return sd;
+	}
+	return NULL;
+}
+
+struct session_database *find_file(struct session *session, char *db_name) {
+	// Compare files rather than names, as the same database can be reached through different paths.
+	char *db_filename;
+	if(asprintf(&db_filename, "%s/%s", db_dir, db_name) == -1)
+		return find_database(session, db_name);
+	struct stat st;
+	int ret = stat(db_filename, &st);
+	free(db_filename);
+	if(ret == -1)
+		return find_database(session, db_name);
+
+	for(int i = 0; i < SESSION_DATABASES; i++) {
+		struct session_database *sd = &session->databases[i];
+		struct stat open_st;
+		if(sd->db != NULL && fstat(sd->db->fd, &open_st) == 0 && open_st.st_dev == st.st_dev && open_st.st_ino == st.st_ino)
+			return sd;
+	}
+	return NULL;
+}
+
+struct session_database *find_idle(struct session *session) {
+	long long t = now();
+	for(int i = 0; i < SESSION_DATABASES; i++) {
+		struct session_database *sd = &session->databases[i];
+		if(sd->db != NULL && t - sd->last_used >= SESSION_IDLE_TIMEOUT * 1000LL)
+			return sd;
+	}
+	return NULL;
+}
+
+void close_idle(struct session *session) {
+	struct session_database *sd;
+	while((sd = find_idle(session)) != NULL) {
+		printf("Closing idle password database %s.\n", sd->name);
+		save_and_close(session, sd);
+	}
+}
+
+void use_database(struct session *session, struct session_database *sd) {
+	session->current = sd;
+	sd->last_used = now();
+
+	// Update the prompt to show the database in use.
+	if(session->prompt != default_prompt)
+		free(session->prompt);
+	if(asprintf(&session->prompt, sd->db->readonly ? "%s (read-only)> " : "%s> ", sd->name) == -1)
+		session->prompt = default_prompt;
+}
+
+int save_and_close(struct session *session, struct session_database *sd) {
+	if(sd == NULL || sd->db == NULL)
+		return 0;
+	int ret = 0;
+	if(!sd->db->readonly && save_database(sd->db) != 0) {
+		database_perror("Error saving database");
+		ret = -1;
+	}
+	close_database(sd->db);
+	free(sd->name);
+	sd->db = NULL;
+	sd->name = NULL;
+
+	// Closing the database in use leaves none in use.
+	if(sd == session->current) {
+		session->current = NULL;
+		if(session->prompt != default_prompt)
+			free(session->prompt);
+		session->prompt = default_prompt;
+	}
+	return ret;
+}
+
+int close_all(struct session *session) {
+	int ret = 0;
+	for(int i = 0; i < SESSION_DATABASES; i++) {
+		if(save_and_close(session, &session->databases[i]) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+long long now() {
+	// Milliseconds, so that databases used within the same second still have an order.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int upgrade(char *db_name, int verbose) {
+	char *db_filename;
+	if(asprintf(&db_filename, "%s/%s", db_dir, db_name) == -1) {
+		fprintf(stderr, "Out of memory.\n");
+		return -1;
+	}
+
+	// Only files in the old layout need upgrading.
+	unsigned int version;
+	if(probe_database(db_filename, &version) != 0) {
+		fprintf(stderr, "%s: ", db_name);
+		database_perror("Error reading database");
+		free(db_filename);
+		return -1;
+	}
+	if(version != 0) {
+		if(verbose)
+			printf("%s is already up to date.\n", db_name);
+		free(db_filename);
+		return 0;
+	}
+
+	// Opening a database in the old layout rewrites it in the current format.
+	char *pass_prompt;
+	if(asprintf(&pass_prompt, "Passphrase for %s: ", db_name) == -1) {
+		fprintf(stderr, "Out of memory.\n");
+		free(db_filename);
+		return -1;
+	}
+	struct database *d;
+	int ret = -1;
+	char *passphrase = read_passphrase(pass_prompt);
+	free(pass_prompt);
+	if(passphrase == NULL) {
+		printf("Passphrase required.\n");
+	}
+	else if(open_database(&d, db_filename, passphrase, 0) != 0) {
+		database_perror("Error opening database");
+	}
+	else if(d->version == 0 && save_database(d) != 0) {
+		database_perror("Error upgrading database");
+		close_database(d);
+	}
+	else {
+		printf("Upgraded %s.\n", db_name);
+		close_database(d);
+		ret = 0;
+	}
+	free(db_filename);
+	return ret;
+}
+
+int scan_databases(int (*callback)(char *, void *), void *data) {
+	DIR *dir = opendir(db_dir);
+	if(dir == NULL) {
+		// The directory only exists once a database has been created.
+		if(errno == ENOENT)
+			return 0;
+		perror("Error reading password database directory");
+		return -1;
+	}
+
+	// Every regular file that isn't hidden is a database, temporary files are hidden. Symlinks are followed like
+	// open does.
+	int ret = 0;
+	struct dirent *entry;
+	// readdir only reports errors through errno, so clear it before each call.
+	while((errno = 0, entry = readdir(dir)) != NULL) {
+		if(entry->d_name[0] == '.')
+			continue;
+		// Not all file systems report the file type, so look it up when it is missing.
+		if(entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if(fstatat(dirfd(dir), entry->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+				continue;
 		}
-		else {
-			save_and_close();
+		else if(entry->d_type != DT_REG)
+			continue;
+		if(callback(entry->d_name, data) != 0) {
+			ret = -1;
+			break;
 		}
 	}
-	else {
-		printf("%s: command not found.\n", keyword);
+	if(entry == NULL && errno != 0) {
+		perror("Error reading password database directory");
+		ret = -1;
 	}
+	closedir(dir);
+	return ret;
 }
 
-void save_and_close() {
-	if(db == NULL)
-		return;
-	if(save_database(db) != 0) {
-		database_perror("Error saving database");
+int matches(const char *name, const char *text) {
+	// Match if the characters of the text appear in the name in order, ignoring case, so substrings and
+	// abbreviations both match.
+	for(; *name && *text; name++) {
+		if(tolower((unsigned char)*name) == tolower((unsigned char)*text))
+			text++;
 	}
-	close_database(db);
-	prompt = DEFAULT_PROMPT;
-	db = NULL;
+	return *text == '\0';
 }
@@ -0,0 +1,88 @@
+/*
+ *   Passwdm: CLI-based password manager.
+ *   Copyright (C) 2012  Daniel Gibbs
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "secure.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Memory for keys and cipher state is handed out in fixed-size slots from a single region that is locked
+// into memory and excluded from core dumps, so one mlock covers every allocation.
+static unsigned char *pool = NULL;
+static void *free_slots = NULL;
+static size_t slots_used = 0;
+static int pool_locked = 0;
+
+static int secure_init() {
+	size_t size = SECURE_SLOT_SIZE * SECURE_SLOTS;
+	void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(region == MAP_FAILED)
+		return -1;
+	madvise(region, size, MADV_DONTDUMP);
+
+	// Locking can fail if RLIMIT_MEMLOCK is too low, the pool is still usable but this is reported in the usage.
+	pool_locked = mlock(region, size) == 0;
+
+	// Thread every slot onto the free list.
+	pool = (unsigned char *)region;
+	for(size_t i = SECURE_SLOTS; i > 0; i--) {
+		void **slot = (void **)(pool + (i - 1) * SECURE_SLOT_SIZE);
+		*slot = free_slots;
+		free_slots = slot;
+	}
+	return 0;
+}
+
+void *secure_alloc(size_t size) {
+	if(size > SECURE_SLOT_SIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if(pool == NULL && secure_init() == -1) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if(free_slots == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Take the first free slot, slots are zeroed when released so only the link needs clearing.
+	void **slot = (void **)free_slots;
+	free_slots = *slot;
+	*slot = NULL;
+	slots_used++;
+	return slot;
+}
+
+void secure_free(void *ptr) {
+	if(ptr == NULL)
+		return;
+	explicit_bzero(ptr, SECURE_SLOT_SIZE);
+	*(void **)ptr = free_slots;
+	free_slots = ptr;
+	slots_used--;
+}
+
+void secure_usage(struct secure_usage *usage) {
+	usage->slot_size = SECURE_SLOT_SIZE;
+	usage->slots_used = slots_used;
+	usage->slots_total = pool ? SECURE_SLOTS : 0;
+	usage->locked = pool_locked;
+}
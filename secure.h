@@ -0,0 +1,38 @@
+/*
+ *   Passwdm: CLI-based password manager.
+ *   Copyright (C) 2012  Daniel Gibbs
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SECURE_H
+#define SECURE_H
+
+#include <stddef.h>
+
+#define SECURE_SLOT_SIZE 512
+#define SECURE_SLOTS 64
+
+struct secure_usage {
+	size_t slot_size;
+	size_t slots_used;
+	size_t slots_total;
+	int locked;
+};
+
+void *secure_alloc(size_t);
+void secure_free(void *);
+void secure_usage(struct secure_usage *);
+
+#endif